@@ -5,10 +5,55 @@
 #include <fstream>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <vector>
+#include <deque>
 #include <string>
 #include <semaphore>
 #include <atomic>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <span>
+#include <coroutine>
+#include <stop_token>
+
+// perf_event_open is only available on Linux
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// SIMD for the --verify order check: SSE2 on x86-64 (and x86 builds that
+// enable it), NEON on 64-bit ARM, plain loop everywhere else
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VERIFY_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define VERIFY_NEON
+#endif
+
+// Compressed input/output, each format needs its library at build time:
+// WITH_ZLIB for gzip, WITH_ZSTD for zstd, WITH_LZ4 for lz4
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4.h>
+#include <lz4frame.h>
+#endif
 
 using namespace std;
 
@@ -86,7 +131,295 @@ struct ThreadTimer
 // Static timer initialized
 atomic<uint64_t> ThreadTimer::globalTimer(0);
 
-void merge(vector<char>& arr, int left, int mid, int right)
+// One line of --perf-counters output
+struct PerfRecord
+{
+    string phase;
+    thread::id threadId;
+    size_t left;
+    size_t right;
+    uint64_t values[5];
+    bool valid[5];
+};
+
+// Hardware performance counters for the calling thread
+// Counts cycles, instructions, branch misses, LLC misses and dTLB misses
+// between start() and stop(). If a counter can't be opened (not Linux,
+// no PMU, perf_event_paranoid too strict) it is reported as NA instead.
+struct PerfCounters
+{
+    static const int numCounters = 5;
+
+    // Set by --perf-counters, everything below is a no-op otherwise
+    static bool enabled;
+
+    // Records from every thread, printed at the end of main
+    static vector<PerfRecord> records;
+    static mutex recordsMutex;
+
+    int fds[numCounters];
+
+    PerfCounters()
+    {
+        for (int i = 0; i < numCounters; i++)
+        {
+            fds[i] = -1;
+        }
+    }
+
+    ~PerfCounters()
+    {
+        closeAll();
+    }
+
+    // Open and enable every counter for this thread
+    void start()
+    {
+        if (!enabled)
+        {
+            return;
+        }
+
+#ifdef __linux__
+        // LLC and dTLB misses are generic cache events: cache | (op << 8) | (result << 16)
+        const uint32_t types[numCounters] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+            PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE };
+        const uint64_t configs[numCounters] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+
+        for (int i = 0; i < numCounters; i++)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            // Time enabled/running lets us scale the count if the kernel multiplexed it
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            // pid 0, cpu -1: this thread on whichever CPU it runs on
+            fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+
+        for (int i = 0; i < numCounters; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // Stop counting and store a record for this phase
+    void stop(const string& phase, size_t left, size_t right)
+    {
+        if (!enabled)
+        {
+            return;
+        }
+        addRecord(take(phase, left, right));
+    }
+
+    // Stop counting and return the record without storing it, for phases
+    // whose bounds are only known after they finish
+    PerfRecord take(const string& phase, size_t left, size_t right)
+    {
+        PerfRecord record;
+        record.phase = phase;
+        record.threadId = this_thread::get_id();
+        record.left = left;
+        record.right = right;
+
+        for (int i = 0; i < numCounters; i++)
+        {
+            record.values[i] = 0;
+            record.valid[i] = false;
+
+#ifdef __linux__
+            if (fds[i] < 0)
+            {
+                continue;
+            }
+
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            // value, time enabled, time running
+            uint64_t buf[3];
+            if (read(fds[i], buf, sizeof(buf)) == (ssize_t)sizeof(buf) && buf[2] > 0)
+            {
+                record.values[i] = buf[2] < buf[1]
+                    ? (uint64_t)((double)buf[0] * buf[1] / buf[2])
+                    : buf[0];
+                record.valid[i] = true;
+            }
+#endif
+        }
+        closeAll();
+        return record;
+    }
+
+    static void addRecord(const PerfRecord& record)
+    {
+        lock_guard<mutex> lock(recordsMutex);
+        records.push_back(record);
+    }
+
+    // True if at least one counter opened
+    bool anyAvailable() const
+    {
+        for (int i = 0; i < numCounters; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void closeAll()
+    {
+        for (int i = 0; i < numCounters; i++)
+        {
+#ifdef __linux__
+            if (fds[i] >= 0)
+            {
+                close(fds[i]);
+            }
+#endif
+            fds[i] = -1;
+        }
+    }
+
+    // Print every record as CSV, prefixed with "perf," so it can be grepped out of stdout
+    static void printRecords(ostream& out)
+    {
+        lock_guard<mutex> lock(recordsMutex);
+
+        out << "perf,phase,thread,left,right,cycles,instructions,branch_misses,llc_misses,dtlb_misses\n";
+        for (const PerfRecord& record : records)
+        {
+            out << "perf," << record.phase << "," << record.threadId << ","
+                << record.left << "," << record.right;
+            for (int i = 0; i < numCounters; i++)
+            {
+                out << ",";
+                if (record.valid[i])
+                {
+                    out << record.values[i];
+                }
+                else
+                {
+                    out << "NA";
+                }
+            }
+            out << "\n";
+        }
+    }
+};
+
+// Static perf counter state initialized
+bool PerfCounters::enabled = false;
+vector<PerfRecord> PerfCounters::records;
+mutex PerfCounters::recordsMutex;
+
+// compareMerge as a functor type
+// Passing this as a template parameter lets the compiler inline the
+// comparison into the merge loops instead of calling through a pointer
+struct CompareMerge
+{
+    bool operator()(char a, char b) const
+    {
+        return compareMerge(a, b);
+    }
+};
+
+// Compare-exchange for sorting networks: after this a is not after b
+// Written without branches so the network runs the same steps for any data
+template <typename Compare>
+inline void compareExchange(char& a, char& b, Compare comp)
+{
+    char x = a;
+    char y = b;
+    bool swapped = comp(y, x);
+    a = swapped ? y : x;
+    b = swapped ? x : y;
+}
+
+// Batcher odd-even merge of the two sorted halves of p[0..N)
+// Compares elements Stride apart, the whole network unrolls at compile time
+template <size_t N, size_t Stride, typename Compare>
+inline void oddEvenMerge(char* p, Compare comp)
+{
+    constexpr size_t step = Stride * 2;
+    if constexpr (step < N)
+    {
+        // Merge the even and odd subsequences, then fix up neighbours
+        oddEvenMerge<N, step>(p, comp);
+        oddEvenMerge<N, step>(p + Stride, comp);
+        for (size_t i = Stride; i + Stride < N; i += step)
+        {
+            compareExchange(p[i], p[i + Stride], comp);
+        }
+    }
+    else
+    {
+        compareExchange(p[0], p[Stride], comp);
+    }
+}
+
+// Fixed-size sorting network for N (a power of two) elements
+template <size_t N, typename Compare>
+inline void sortNetwork(char* p, Compare comp)
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "sortNetwork needs a power of two size");
+    if constexpr (N > 1)
+    {
+        sortNetwork<N / 2>(p, comp);
+        sortNetwork<N / 2>(p + N / 2, comp);
+        oddEvenMerge<N, 1>(p, comp);
+    }
+}
+
+// Sorts small power of two segments with a network
+// Returns false if there's no network for this size
+template <typename Compare>
+inline bool sortSmallSegment(char* p, size_t size, Compare comp)
+{
+    switch (size)
+    {
+    case 2:
+        sortNetwork<2>(p, comp);
+        return true;
+    case 4:
+        sortNetwork<4>(p, comp);
+        return true;
+    case 8:
+        sortNetwork<8>(p, comp);
+        return true;
+    case 16:
+        sortNetwork<16>(p, comp);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Merges the sorted ranges [left, mid] and [mid + 1, right]
+// Index is int for normal inputs, size_t once positions don't fit in an int
+template <typename Index, typename Compare>
+void merge(span<char> arr, Index left, Index mid, Index right, Compare comp)
 {
     // To gather time for the merge operation:
     uint64_t startTime = ThreadTimer::getTime();
@@ -95,19 +428,19 @@ void merge(vector<char>& arr, int left, int mid, int right)
     vector<char> temp(right - left + 1);
     
     // index for the first half
-    int i = left;
+    Index i = left;
     
     // index for the second half
-    int j = mid + 1;
+    Index j = mid + 1;
 
     // index for the temp array
-    int k = 0;
+    size_t k = 0;
 
     // Compare and merge from both halves
     while (i <= mid && j <= right)
     {
         // Compare elements using the custom comparison
-        if (compareMerge(arr[i], arr[j]))
+        if (comp(arr[i], arr[j]))
         {
             // Take from first half into temp array
             temp[k++] = arr[i++];
@@ -132,9 +465,9 @@ void merge(vector<char>& arr, int left, int mid, int right)
     }
     
     // Copy back the merged results to the original array
-    for (i = 0; i < k; i++)
+    for (size_t m = 0; m < k; m++)
     {
-        arr[left + i] = temp[i];
+        arr[left + m] = temp[m];
     }
 
     // Print out the time taken
@@ -157,199 +490,2321 @@ uint64_t getCurrentTime()
 }
 
 // Non-parallel merge sort
-void regularMergeSort(vector<char>& arr, int left, int right) 
+template <typename Index, typename Compare>
+void regularMergeSort(span<char> arr, Index left, Index right, Compare comp) 
 {
     // If there are two elements or more, sort.
     if (left < right)
     {
+        // Small power of two segments go through a sorting network instead
+        if (sortSmallSegment(arr.data() + left, right - left + 1, comp))
+        {
+            return;
+        }
+
         // Find middle
-        int mid = left + (right - left) / 2;
+        Index mid = left + (right - left) / 2;
 
         // Sort first & second halves (recursively)
-        regularMergeSort(arr, left, mid);
-        regularMergeSort(arr, mid + 1, right);
+        regularMergeSort(arr, left, mid, comp);
+        regularMergeSort(arr, mid + 1, right, comp);
 
         // Merge the sorted halves
-        merge(arr, left, mid, right);
+        merge(arr, left, mid, right, comp);
     }
 }
 
 
-// Parallel merge sort
-void parallelMergeSort(vector<char>& arr, int left, int right, int depth)
+// Calls sortWith(Index()) with the index type to use for size elements:
+// int while it fits, size_t for inputs of 2 GB and up. Every sort entry
+// point picks it here once, so the recursion never re-checks it.
+// The cutoff is size <= INT_MAX, not size - 1: merge and the copy loops
+// compute right + 1 (segment lengths, j++ past the end), so that must fit too
+template <typename SortWith>
+void withIndexType(size_t size, SortWith sortWith)
 {
-    uint64_t startTime = ThreadTimer::getTime();
-    // Use the regularMergeSort if we have used all the thread depth
-    if (depth <= 0) 
+    if (size <= (size_t)INT_MAX)
     {
-        regularMergeSort(arr, left, right);
-        return;
+        sortWith(int());
+    }
+    else
+    {
+        sortWith(size_t());
     }
-   
+}
 
-    // Find middle
-    int mid = left + (right - left) / 2;
+// Async sorting
+// The split/merge tree as separate tasks: one per leaf sort, one per merge.
+// A merge task is posted once both of its children finish, and the last
+// one finishes the sort. Nothing waits inside a task, so the tasks can run
+// on a caller's event loop or thread pool without blocking it.
 
-    // Creating thread to handle the left part
-    thread leftThread([&arr, left, mid, depth]()
-        {
-            // Start time of thread
-            uint64_t threadStart = ThreadTimer::getTime();
-            
-            // Recursively calling the function while reducing the thread depth
-            parallelMergeSort(arr, left, mid, depth - 1);
+// Runs one task, e.g. by posting it to an event loop or thread pool
+typedef function<void(function<void()>)> SortExecutor;
 
-            // End time of thread
-            uint64_t threadEnd = ThreadTimer::getTime();
+struct SortOptions
+{
+    // Same as thread_depth: how many levels the tree splits before leaf sorts
+    int depth = 0;
 
-            // Printing out time of left thread
-            cout << "Thread " << this_thread::get_id()
-                 << " time: " << (threadEnd - threadStart) << " units\n";
-        });
-    
-    // Use current thread for right half
-    uint64_t rightStart = ThreadTimer::getTime();
-    parallelMergeSort(arr, mid + 1, right, depth - 1);
-    uint64_t rightEnd = ThreadTimer::getTime();
+    // Where tasks run, each task gets its own thread if this is empty
+    SortExecutor executor;
 
-    // Printing out time of right thread
-    cout << "Thread " << this_thread::get_id()
-         << " right half time: " << (rightEnd - rightStart) << " units\n";
+    // Checked at the start of every task, a cancelled sort leaves the data
+    // with its characters intact but only partly sorted
+    stop_token stopToken;
 
-    // Join the left thread to complete
-    leftThread.join();
+    // Called after each task with the bytes merged so far, counting every
+    // level, so it ends at size * (levels + 1). Runs on the task's thread,
+    // but never concurrently and always with a growing total: calls are
+    // made under a lock, so a slow callback holds up finishing tasks.
+    function<void(size_t)> onProgress;
+};
 
-    // Merge the sorted halves
-    merge(arr, left, mid, right);
-}
+enum class SortStatus
+{
+    Completed,
+    Cancelled
+};
 
-// Main function:
-// - Will process command line arguments
-// - Reads and filters input file
-// - Background timer thread
-// - Initiates Parallel sorting
-// - Write results and timing information
-int main(int argc, char* argv[])
+// State shared by every task of one sort
+struct SortJob : enable_shared_from_this<SortJob>
 {
-    // Check command line arguments
-    // Checks for exactly 4 arguments
-    // Prints usage instructions if incorrect number of arguments
-    if (argc != 4)
+    SortOptions options;
+    atomic<bool> cancelled;
+
+    // Progress total, onProgress is called while holding progressMutex
+    size_t bytesMerged;
+    mutex progressMutex;
+
+    // First exception thrown by a task, the rest of the tasks are skipped
+    exception_ptr error;
+    mutex errorMutex;
+
+    // Called once, on the thread that finished the last task, may be empty
+    function<void()> onDone;
+
+    // Run each merge on the thread that finished its second child instead
+    // of posting it, so the executor only ever sees the leaf tasks
+    bool inlineMerges;
+
+    SortJob(const SortOptions& options)
+        : options(options), cancelled(false), bytesMerged(0), inlineMerges(false)
     {
-        cerr << "Usage: " << argv[0] << " <input_file> <output_file> <thread_depth>\n";
-        cerr << "thread_depth: 0 for regular, 1 for 2 threads, 2 for 4 threads, etc.\n";
-        return 1;
     }
 
-    // Read input file
-    // Opens input file in binary mode using name from first argument
-    ifstream inFile(argv[1], ios::binary);
+    virtual ~SortJob()
+    {
+    }
 
-    // Check if file is opened successfully
-    if (!inFile)
+    // Posts the leaf tasks
+    virtual void start() = 0;
+
+    void post(function<void()> task)
     {
-        cerr << "Error opening input file\n";
-        return 1;
+        if (options.executor)
+        {
+            options.executor(move(task));
+        }
+        else
+        {
+            thread(move(task)).detach();
+        }
     }
 
-    // Get file size for reporting, get file size by moving to end and checking position
-    // Move to end of file
-    inFile.seekg(0, ios::end);
+    // True once the sort should skip the remaining work
+    bool stopping()
+    {
+        if (!cancelled && options.stopToken.stop_requested())
+        {
+            cancelled = true;
+        }
+        return cancelled;
+    }
 
-    // Get current position (File size)
-    size_t fileSize = inFile.tellg();
+    // Runs the work for one task, unless the sort is stopping
+    template <typename Work>
+    void runTask(size_t bytes, Work work)
+    {
+        if (stopping())
+        {
+            return;
+        }
 
-    // Move back to start for file reading
-    inFile.seekg(0, ios::beg);
+        try
+        {
+            work();
+        }
+        catch (...)
+        {
+            lock_guard<mutex> lock(errorMutex);
+            if (!error)
+            {
+                error = current_exception();
+            }
+            cancelled = true;
+            return;
+        }
 
-    // Read entire file into memory
-    vector<char> data;
-    
-    // Pre allocate to avoid resizing
-    data.reserve(fileSize); 
-    char c;
+        if (options.onProgress)
+        {
+            lock_guard<mutex> lock(progressMutex);
+            bytesMerged += bytes;
+            options.onProgress(bytesMerged);
+        }
+    }
+};
 
-    // Reads file character by character and filters
-    while (inFile.get(c))
+// The tree for one index type and comparator
+template <typename Index, typename Compare>
+struct SortTreeJob : SortJob
+{
+    struct Node
     {
-        // Only include valid characters (0-9, A-Z, a-z)
-        if ((c >= '0' && c <= '9') ||
-            (c >= 'A' && c <= 'Z') ||
-            (c >= 'a' && c <= 'z'))
+        Index left;
+        Index mid;
+        Index right;
+        Node* parent;
+
+        // Children still running, 0 for leaves
+        atomic<int> pending;
+    };
+
+    span<char> arr;
+    Index left;
+    Index right;
+    Compare comp;
+
+    vector<unique_ptr<Node>> nodes;
+    vector<Node*> leaves;
+
+    SortTreeJob(span<char> arr, Index left, Index right, const SortOptions& options, Compare comp)
+        : SortJob(options), arr(arr), left(left), right(right), comp(comp)
+    {
+    }
+
+    // Splits [left, right] the same way parallelMergeSort always has
+    Node* build(Index left, Index right, int depth, Node* parent)
+    {
+        nodes.push_back(unique_ptr<Node>(new Node()));
+        Node* node = nodes.back().get();
+        node->left = left;
+        node->right = right;
+        node->parent = parent;
+        node->pending = 0;
+
+        if (depth <= 0 || left >= right)
         {
-            data.push_back(c);
+            leaves.push_back(node);
+            return node;
         }
+
+        node->mid = left + (right - left) / 2;
+        node->pending = 2;
+        build(left, node->mid, depth - 1, node);
+        build(node->mid + 1, right, depth - 1, node);
+        return node;
     }
-    // Close file
-    inFile.close();
 
-    // Check to see if any valid characters are found
-    if (data.empty())
+    void start() override
     {
-        cerr << "No valid characters found in the input file, remember only numbers, upper & lowercase letters are allowed!\n";
-        return 1;
+        build(left, right, options.depth, NULL);
+
+        shared_ptr<SortTreeJob> self = static_pointer_cast<SortTreeJob>(shared_from_this());
+        for (Node* leaf : leaves)
+        {
+            post([self, leaf]()
+                {
+                    self->runLeaf(leaf);
+                });
+        }
     }
 
-    // Get thread depth from command line
-    // Converts third argument into integer for thread depth, makes sure thread depth is not negative
-    // stoi converts string to int
-    int threadDepth = stoi(argv[3]);
-    if (threadDepth < 0)
+    // Bytes in a node's segment, counted in size_t so right + 1 never
+    // has to fit in Index
+    static size_t segmentSize(const Node* node)
     {
-        cerr << "Thread depth must be non-negative\n";
-        return 1;
+        return (size_t)(node->right - node->left) + 1;
     }
 
-    // Print initial info
-    // Print sorting parameters, input size, and thread configuration
-    cout << "Starting sort with parameters:\n"
-         << "Input size: " << data.size() << " characters\n"
-         << "Thread depth: " << threadDepth << "\n"
-         << "Maximum possible threads: " << (1 << threadDepth) << "\n\n";
+    void runLeaf(Node* leaf)
+    {
+        runTask(segmentSize(leaf), [this, leaf]()
+            {
+                uint64_t startTime = ThreadTimer::getTime();
 
-    // Get start time
-    uint64_t startTime = ThreadTimer::getTime();
+                PerfCounters sortCounters;
+                sortCounters.start();
+                regularMergeSort(arr, leaf->left, leaf->right, comp);
+                sortCounters.stop("sort", leaf->left, leaf->right);
 
-    // Start a timer thread
-    // Background thread for timing
-    thread timerThread([]()
+                uint64_t endTime = ThreadTimer::getTime();
+                cout << "Thread " << this_thread::get_id()
+                     << " sort time for segment [" << leaf->left << "," << leaf->right << "]: "
+                     << (endTime - startTime) << " units\n";
+            });
+        finished(leaf);
+    }
+
+    void runMerge(Node* node)
+    {
+        runTask(segmentSize(node), [this, node]()
+            {
+                PerfCounters mergeCounters;
+                mergeCounters.start();
+                merge(arr, node->left, node->mid, node->right, comp);
+                mergeCounters.stop("merge", node->left, node->right);
+            });
+        finished(node);
+    }
+
+    // Starts the parent's merge once both halves are done, or ends the sort at the root
+    void finished(Node* node)
+    {
+        Node* parent = node->parent;
+        if (!parent)
         {
-            while (true)
+            if (onDone)
             {
-                // Thread continuously increments timer
-                ThreadTimer::incremementTimer();
+                onDone();
+            }
+            return;
+        }
 
-                // Sleep to prevent excessive CPU usage
-                this_thread::yield();
+        if (--parent->pending == 0)
+        {
+            if (inlineMerges)
+            {
+                runMerge(parent);
+                return;
             }
-        });
-    // Let it run independantly 
-    timerThread.detach();
 
-    // Sort the data
-    parallelMergeSort(data, 0, data.size() - 1, threadDepth);
+            shared_ptr<SortTreeJob> self = static_pointer_cast<SortTreeJob>(shared_from_this());
+            post([self, parent]()
+                {
+                    self->runMerge(parent);
+                });
+        }
+    }
+};
 
-    // Records end time
-    uint64_t endTime = ThreadTimer::getTime();
+// What sort_async returns, co_await it to run the sort
+// The awaiting coroutine resumes on whichever executor task finished last
+struct SortAwaitable
+{
+    shared_ptr<SortJob> job;
 
-    // Write to output file
-    ofstream outFile(argv[2]);
+    // An empty span has nothing to sort
+    bool await_ready() const
+    {
+        return !job;
+    }
 
-    // Check if file opened successfully
-    if (!outFile) 
+    void await_suspend(coroutine_handle<> caller)
     {
-        cerr << "Error opening output file\n";
-        return 1;
+        // The caller can resume (and drop this awaitable) before start() returns
+        shared_ptr<SortJob> running = job;
+        running->onDone = [caller]()
+            {
+                caller.resume();
+            };
+        running->start();
     }
 
-    // Writes sorted characters to file
-    for (char c : data)
+    // Rethrows anything a task threw
+    SortStatus await_resume()
     {
-        outFile << c;
+        if (job && job->error)
+        {
+            rethrow_exception(job->error);
+        }
+        return job && job->cancelled ? SortStatus::Cancelled : SortStatus::Completed;
     }
+};
 
-    // Closes output file
-    outFile.close();
+// Sorts data with compareMerge rules without blocking the caller
+// Usage: SortStatus status = co_await sort_async(data, options);
+// data must stay alive until the co_await finishes
+SortAwaitable sort_async(span<char> data, SortOptions options)
+{
+    SortAwaitable awaitable;
+    if (data.empty())
+    {
+        return awaitable;
+    }
+
+    withIndexType(data.size(), [&awaitable, data, &options](auto zero)
+        {
+            typedef decltype(zero) Index;
+            awaitable.job = make_shared<SortTreeJob<Index, CompareMerge>>(
+                data, 0, (Index)(data.size() - 1), options, CompareMerge());
+        });
+    return awaitable;
+}
+
+// Parallel merge sort
+// Synchronous wrapper around the async tree: one thread per leaf, with the
+// last leaf sorted on the calling thread. Merges run inline on whichever
+// thread finished the second half, so the root merge ends on one of them.
+template <typename Index, typename Compare>
+void parallelMergeSort(span<char> arr, Index left, Index right, int depth, Compare comp)
+{
+    // start() only hands out the leaves, collect them here
+    vector<function<void()>> leafTasks;
+
+    SortOptions options;
+    options.depth = depth;
+    options.executor = [&leafTasks](function<void()> task)
+        {
+            leafTasks.push_back(move(task));
+        };
+
+    shared_ptr<SortTreeJob<Index, Compare>> job =
+        make_shared<SortTreeJob<Index, Compare>>(arr, left, right, options, comp);
+    job->inlineMerges = true;
+    job->start();
+
+    vector<thread> threads;
+    for (size_t i = 0; i + 1 < leafTasks.size(); i++)
+    {
+        threads.push_back(thread(move(leafTasks[i])));
+    }
+    leafTasks.back()();
+
+    for (thread& leafThread : threads)
+    {
+        leafThread.join();
+    }
+
+    if (job->error)
+    {
+        rethrow_exception(job->error);
+    }
+}
+
+// Sorts all of arr
+template <typename Compare>
+void sortData(vector<char>& arr, int depth, Compare comp)
+{
+    if (arr.empty())
+    {
+        return;
+    }
+
+    withIndexType(arr.size(), [&arr, depth, comp](auto zero)
+        {
+            typedef decltype(zero) Index;
+            parallelMergeSort<Index>(arr, 0, (Index)(arr.size() - 1), depth, comp);
+        });
+}
+
+// Per-character counts, used to check sorting didn't lose or invent characters
+typedef array<uint64_t, 256> CharHistogram;
+
+// compareMerge puts digits, then uppercase, then lowercase, which is also
+// their ASCII order. Check that once so the verifier can compare raw bytes
+// with SIMD instead of calling compareMerge per pair.
+bool compareMergeIsByteOrder()
+{
+    string valid;
+    for (int c = 0; c < 256; c++)
+    {
+        if ((c >= '0' && c <= '9') ||
+            (c >= 'A' && c <= 'Z') ||
+            (c >= 'a' && c <= 'z'))
+        {
+            valid.push_back((char)c);
+        }
+    }
+
+    for (char a : valid)
+    {
+        for (char b : valid)
+        {
+            if (compareMerge(a, b) != ((unsigned char)a < (unsigned char)b))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// True if any pair bytes[i] > bytes[i + 1] has i in [begin, pairEnd)
+// Compares 16 pairs at a time with SSE2 or NEON when the target has them
+bool bytesOutOfOrder(const unsigned char* bytes, size_t begin, size_t pairEnd)
+{
+    size_t i = begin;
+
+#if defined(VERIFY_SSE2)
+    // x <= y exactly when max(x, y) == y, keep the AND of that over every lane
+    __m128i inOrder = _mm_set1_epi8(-1);
+    for (; i + 16 <= pairEnd; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(bytes + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(bytes + i + 1));
+        inOrder = _mm_and_si128(inOrder, _mm_cmpeq_epi8(_mm_max_epu8(x, y), y));
+    }
+    if (_mm_movemask_epi8(inOrder) != 0xFFFF)
+    {
+        return true;
+    }
+#elif defined(VERIFY_NEON)
+    // Lanes where x > y are all ones, keep the OR of that over every lane
+    uint8x16_t outOfOrder = vdupq_n_u8(0);
+    for (; i + 16 <= pairEnd; i += 16)
+    {
+        uint8x16_t x = vld1q_u8(bytes + i);
+        uint8x16_t y = vld1q_u8(bytes + i + 1);
+        outOfOrder = vorrq_u8(outOfOrder, vcgtq_u8(x, y));
+    }
+    if (vmaxvq_u8(outOfOrder) != 0)
+    {
+        return true;
+    }
+#endif
+
+    // Whatever is left over, or everything without SIMD
+    for (; i < pairEnd; i++)
+    {
+        if (bytes[i] > bytes[i + 1])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Verifier work for one thread over [begin, end) of data
+// Counts every character, and if checkOrder is set, finds the first i in
+// the range where data[i + 1] should come before data[i]. The last pair
+// reaches into the next chunk, so chunk boundaries are covered too.
+// Works in small blocks so the order check and the counting share one
+// pass over memory.
+void verifyChunk(const char* data, size_t size, size_t begin, size_t end,
+                 bool checkOrder, bool byteOrder, CharHistogram& counts, size_t& firstBad)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    const size_t blockSize = 4096;
+
+    // Four sets of counts so repeated characters don't stall on the same counter
+    uint64_t partial[4][256] = {};
+
+    firstBad = size;
+    for (size_t blockStart = begin; blockStart < end; blockStart += blockSize)
+    {
+        size_t blockEnd = min(blockStart + blockSize, end);
+
+        // Check adjacent pairs until the first bad one is found
+        size_t pairEnd = min(blockEnd, size - 1);
+        if (checkOrder && firstBad == size && blockStart < pairEnd)
+        {
+            bool bad = false;
+            if (byteOrder)
+            {
+                bad = bytesOutOfOrder(bytes, blockStart, pairEnd);
+            }
+            else
+            {
+                for (size_t i = blockStart; i < pairEnd && !bad; i++)
+                {
+                    bad = compareMerge(data[i + 1], data[i]);
+                }
+            }
+
+            // Only search for the exact position once we know it's in this block
+            if (bad)
+            {
+                for (size_t i = blockStart; i < pairEnd; i++)
+                {
+                    if (compareMerge(data[i + 1], data[i]))
+                    {
+                        firstBad = i;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Count the same block while it's still in cache
+        size_t i = blockStart;
+        for (; i + 4 <= blockEnd; i += 4)
+        {
+            partial[0][bytes[i]]++;
+            partial[1][bytes[i + 1]]++;
+            partial[2][bytes[i + 2]]++;
+            partial[3][bytes[i + 3]]++;
+        }
+        for (; i < blockEnd; i++)
+        {
+            partial[0][bytes[i]]++;
+        }
+    }
+
+    for (int c = 0; c < 256; c++)
+    {
+        counts[c] = partial[0][c] + partial[1][c] + partial[2][c] + partial[3][c];
+    }
+
+}
+
+// Counts the characters of data, split across threads
+// This is how --verify counts the input before it's sorted
+CharHistogram countParallel(const vector<char>& data)
+{
+    // Keep chunks big enough that starting a thread is worth it
+    const size_t minChunk = 1 << 16;
+    size_t threadCount = max<size_t>(1, thread::hardware_concurrency());
+    threadCount = max<size_t>(1, min(threadCount, data.size() / minChunk));
+
+    vector<CharHistogram> counts(threadCount);
+    vector<thread> workers;
+
+    size_t chunkSize = (data.size() + threadCount - 1) / threadCount;
+    for (size_t t = 0; t < threadCount; t++)
+    {
+        size_t begin = min(t * chunkSize, data.size());
+        size_t end = min(begin + chunkSize, data.size());
+        if (begin == end)
+        {
+            counts[t].fill(0);
+            continue;
+        }
+
+        workers.emplace_back([&data, begin, end, &counts, t]()
+            {
+                PerfCounters verifyCounters;
+                verifyCounters.start();
+
+                size_t unused;
+                verifyChunk(data.data(), data.size(), begin, end, false, false, counts[t], unused);
+
+                verifyCounters.stop("verify", begin, end - 1);
+            });
+    }
+
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    CharHistogram total;
+    total.fill(0);
+    for (size_t t = 0; t < threadCount; t++)
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            total[c] += counts[t][c];
+        }
+    }
+    return total;
+}
+
+// Checks the sorted output as it's written, on threads of its own
+// The writer hands each block to check() and carries on, the block is
+// split across the verify threads the same way countParallel splits the
+// input. Checking overlaps the final merge without slowing the writer,
+// and the output is never read a second time. Blocks must stay in memory
+// until finish(), which waits for the checks and adds up the results.
+struct StreamVerifier
+{
+    // Part of one block for one thread
+    struct Slice
+    {
+        const char* block;
+        size_t blockSize;
+        size_t begin;
+        size_t end;
+
+        // Output index of block[0]
+        size_t index;
+
+        // The character before block[0], if there was one
+        bool hasPrevious;
+        char previous;
+    };
+
+    bool byteOrder;
+
+    // Set by finish(): the output's counts, and the first index whose next
+    // character should come before it, SIZE_MAX if none
+    CharHistogram counts;
+    size_t firstBad;
+
+    // Slices waiting for a thread
+    deque<Slice> queue;
+    mutex queueMutex;
+    condition_variable queueChanged;
+    bool closing;
+
+    vector<thread> workers;
+    vector<CharHistogram> threadCounts;
+    vector<size_t> threadFirstBad;
+
+    // Output handed over so far, and its last character
+    size_t checked;
+    char last;
+
+    StreamVerifier() : byteOrder(compareMergeIsByteOrder()), firstBad(SIZE_MAX), closing(false), checked(0), last(0)
+    {
+        counts.fill(0);
+
+        size_t threadCount = max<size_t>(1, thread::hardware_concurrency());
+        threadCounts.resize(threadCount);
+        threadFirstBad.resize(threadCount, SIZE_MAX);
+        for (size_t t = 0; t < threadCount; t++)
+        {
+            threadCounts[t].fill(0);
+            workers.emplace_back([this, t]()
+                {
+                    work(t);
+                });
+        }
+    }
+
+    ~StreamVerifier()
+    {
+        finish();
+    }
+
+    // Queues the next size bytes of output
+    void check(const char* block, size_t size)
+    {
+        if (size == 0)
+        {
+            return;
+        }
+
+        // Keep slices big enough to be worth handing to another thread
+        const size_t minSlice = 1 << 16;
+        size_t sliceCount = max<size_t>(1, min(workers.size(), size / minSlice));
+        size_t sliceSize = (size + sliceCount - 1) / sliceCount;
+
+        {
+            lock_guard<mutex> lock(queueMutex);
+            for (size_t begin = 0; begin < size; begin += sliceSize)
+            {
+                queue.push_back({ block, size, begin, min(begin + sliceSize, size), checked, checked > 0, last });
+            }
+        }
+        queueChanged.notify_all();
+
+        last = block[size - 1];
+        checked += size;
+    }
+
+    // Waits for every queued slice, then fills in counts and firstBad
+    void finish()
+    {
+        if (workers.empty())
+        {
+            return;
+        }
+
+        {
+            lock_guard<mutex> lock(queueMutex);
+            closing = true;
+        }
+        queueChanged.notify_all();
+
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+
+        for (size_t t = 0; t < threadCounts.size(); t++)
+        {
+            for (int c = 0; c < 256; c++)
+            {
+                counts[c] += threadCounts[t][c];
+            }
+            firstBad = min(firstBad, threadFirstBad[t]);
+        }
+    }
+
+    // One verify thread: takes slices until finish() and the queue is empty
+    void work(size_t t)
+    {
+        PerfCounters verifyCounters;
+        verifyCounters.start();
+
+        // Output indices this thread looked at, for its perf row
+        size_t lowest = SIZE_MAX;
+        size_t highest = 0;
+
+        while (true)
+        {
+            Slice slice;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                queueChanged.wait(lock, [this]()
+                    {
+                        return closing || !queue.empty();
+                    });
+                if (queue.empty())
+                {
+                    break;
+                }
+                slice = queue.front();
+                queue.pop_front();
+            }
+
+            // Slices come off the queue in output order, so once this
+            // thread has found a bad pair, anything later can't be first
+            bool checkOrder = threadFirstBad[t] == SIZE_MAX;
+
+            // The pair that spans the previous block and this one
+            if (checkOrder && slice.begin == 0 && slice.hasPrevious && compareMerge(slice.block[0], slice.previous))
+            {
+                threadFirstBad[t] = slice.index - 1;
+                checkOrder = false;
+            }
+
+            CharHistogram sliceCounts;
+            size_t sliceBad;
+            verifyChunk(slice.block, slice.blockSize, slice.begin, slice.end, checkOrder, byteOrder, sliceCounts, sliceBad);
+            if (checkOrder && sliceBad != slice.blockSize)
+            {
+                threadFirstBad[t] = slice.index + sliceBad;
+            }
+
+            for (int c = 0; c < 256; c++)
+            {
+                threadCounts[t][c] += sliceCounts[c];
+            }
+
+            lowest = min(lowest, slice.index + slice.begin);
+            highest = max(highest, slice.index + slice.end - 1);
+        }
+
+        if (lowest != SIZE_MAX)
+        {
+            verifyCounters.stop("verify", lowest, highest);
+        }
+    }
+};
+
+// Size of each read from disk, each decompressed block, and each block
+// handed to the output writer
+const size_t ioBlockSize = 1 << 20;
+
+// True for the characters we sort (0-9, A-Z, a-z)
+inline bool isValidChar(char c)
+{
+    return (c >= '0' && c <= '9') ||
+           (c >= 'A' && c <= 'Z') ||
+           (c >= 'a' && c <= 'z');
+}
+
+// Appends the valid characters of buf to data
+void filterChars(const char* buf, size_t size, vector<char>& data)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (isValidChar(buf[i]))
+        {
+            data.push_back(buf[i]);
+        }
+    }
+}
+
+// Copies the valid characters of buf to out and returns how many there were
+// out may be buf itself, the copy only ever moves characters forward
+size_t filterChars(const char* buf, size_t size, char* out)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (isValidChar(buf[i]))
+        {
+            out[kept++] = buf[i];
+        }
+    }
+    return kept;
+}
+
+// Formats we can read and write
+enum class StreamFormat
+{
+    Plain,
+    Gzip,
+    Zstd,
+    Lz4
+};
+
+const char* formatName(StreamFormat format)
+{
+    switch (format)
+    {
+    case StreamFormat::Gzip:
+        return "gzip";
+    case StreamFormat::Zstd:
+        return "zstd";
+    case StreamFormat::Lz4:
+        return "lz4";
+    default:
+        return "plain";
+    }
+}
+
+// Each compressed format needs its library at build time
+bool formatSupported(StreamFormat format)
+{
+    switch (format)
+    {
+    case StreamFormat::Gzip:
+#ifdef WITH_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case StreamFormat::Zstd:
+#ifdef WITH_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    case StreamFormat::Lz4:
+#ifdef WITH_LZ4
+        return true;
+#else
+        return false;
+#endif
+    default:
+        return true;
+    }
+}
+
+// Compressed input is recognised by its magic bytes
+StreamFormat detectInputFormat(const unsigned char* head, size_t size)
+{
+    if (size >= 2 && head[0] == 0x1f && head[1] == 0x8b)
+    {
+        return StreamFormat::Gzip;
+    }
+    if (size >= 4 && head[0] == 0x28 && head[1] == 0xb5 && head[2] == 0x2f && head[3] == 0xfd)
+    {
+        return StreamFormat::Zstd;
+    }
+    if (size >= 4 && head[0] == 0x04 && head[1] == 0x22 && head[2] == 0x4d && head[3] == 0x18)
+    {
+        return StreamFormat::Lz4;
+    }
+    return StreamFormat::Plain;
+}
+
+// Compressed output is picked by the output file's extension
+StreamFormat outputFormatFor(const string& path)
+{
+    auto endsWith = [&path](const string& ext)
+        {
+            return path.size() >= ext.size() &&
+                   path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+        };
+
+    if (endsWith(".gz"))
+    {
+        return StreamFormat::Gzip;
+    }
+    if (endsWith(".zst"))
+    {
+        return StreamFormat::Zstd;
+    }
+    if (endsWith(".lz4"))
+    {
+        return StreamFormat::Lz4;
+    }
+    return StreamFormat::Plain;
+}
+
+// Reads an uncompressed file in blocks
+bool readPlain(ifstream& inFile, vector<char>& data)
+{
+    vector<char> buf(ioBlockSize);
+    while (inFile)
+    {
+        inFile.read(buf.data(), buf.size());
+        filterChars(buf.data(), (size_t)inFile.gcount(), data);
+    }
+    return !inFile.bad();
+}
+
+// Loads a whole compressed file, for formats that are split up before decoding
+// Compressed data is small compared to the output, so this is cheap
+bool loadCompressed(ifstream& inFile, size_t fileSize, vector<char>& src, const char* format)
+{
+    src.resize(fileSize);
+    inFile.read(src.data(), fileSize);
+    if ((size_t)inFile.gcount() != fileSize)
+    {
+        cerr << "Error reading " << format << " input\n";
+        return false;
+    }
+    return true;
+}
+
+// Decodes independent pieces of a compressed file on several threads
+// Piece i decodes to at most bounds[i] bytes, so it gets that much room in
+// data at the sum of the bounds before it, and decode(i, out, kept) filters
+// it straight into out and sets kept to the characters it kept. Threads
+// take the next piece until none are left. Filtering can only leave gaps,
+// which are closed in file order afterwards, so nothing is held twice.
+// With --perf-counters each piece gets a read row on the thread that
+// decoded it, covering the characters it ended up as.
+bool decodePiecesParallel(const vector<size_t>& bounds,
+                          const function<bool(size_t, char*, size_t&)>& decode, vector<char>& data)
+{
+    size_t count = bounds.size();
+
+    // Where each piece starts in data
+    vector<size_t> offsets(count + 1);
+    offsets[0] = data.size();
+    for (size_t i = 0; i < count; i++)
+    {
+        offsets[i + 1] = offsets[i] + bounds[i];
+    }
+    data.resize(offsets[count]);
+
+    vector<size_t> kept(count, 0);
+    vector<PerfRecord> pieceRecords(PerfCounters::enabled ? count : 0);
+    atomic<size_t> nextPiece(0);
+    atomic<bool> ok(true);
+
+    size_t threadCount = max<size_t>(1, min<size_t>(count, thread::hardware_concurrency()));
+    vector<thread> workers;
+    for (size_t t = 0; t < threadCount; t++)
+    {
+        workers.emplace_back([&]()
+            {
+                for (size_t i = nextPiece++; i < count && ok; i = nextPiece++)
+                {
+                    PerfCounters pieceCounters;
+                    pieceCounters.start();
+
+                    if (!decode(i, data.data() + offsets[i], kept[i]))
+                    {
+                        ok = false;
+                    }
+
+                    // Its place in data isn't known until every piece is done
+                    if (PerfCounters::enabled)
+                    {
+                        pieceRecords[i] = pieceCounters.take("read", 0, 0);
+                    }
+                }
+            });
+    }
+
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    if (!ok)
+    {
+        return false;
+    }
+
+    // Close the gaps left by filtered out characters, moving nothing when
+    // every character was valid
+    size_t end = offsets[0];
+    for (size_t i = 0; i < count; i++)
+    {
+        if (end != offsets[i])
+        {
+            memmove(data.data() + end, data.data() + offsets[i], kept[i]);
+        }
+
+        if (PerfCounters::enabled)
+        {
+            pieceRecords[i].left = end;
+            pieceRecords[i].right = kept[i] > 0 ? end + kept[i] - 1 : end;
+            PerfCounters::addRecord(pieceRecords[i]);
+        }
+        end += kept[i];
+    }
+    data.resize(end);
+    return true;
+}
+
+#ifdef WITH_ZLIB
+// Streams a gzip file through zlib straight into the filter
+// gzip has no block index, so this one is sequential
+bool readGzip(ifstream& inFile, vector<char>& data)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    // 15 + 32: accept a gzip or zlib header
+    if (inflateInit2(&zs, 15 + 32) != Z_OK)
+    {
+        cerr << "Error starting gzip decompression\n";
+        return false;
+    }
+
+    vector<char> in(ioBlockSize);
+    vector<char> out(ioBlockSize);
+    bool ok = true;
+    bool memberEnded = false;
+
+    while (ok)
+    {
+        // Refill the input when zlib has used it all
+        if (zs.avail_in == 0)
+        {
+            inFile.read(in.data(), in.size());
+            zs.next_in = (Bytef*)in.data();
+            zs.avail_in = (uInt)inFile.gcount();
+            if (zs.avail_in == 0)
+            {
+                break;
+            }
+        }
+
+        zs.next_out = (Bytef*)out.data();
+        zs.avail_out = (uInt)out.size();
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        filterChars(out.data(), out.size() - zs.avail_out, data);
+
+        if (ret == Z_STREAM_END)
+        {
+            // Concatenated .gz files (cat a.gz b.gz) and bgzip output have several members, keep going
+            memberEnded = true;
+            inflateReset(&zs);
+        }
+        else if (ret == Z_OK || ret == Z_BUF_ERROR)
+        {
+            memberEnded = false;
+        }
+        else
+        {
+            cerr << "Error decompressing gzip input: " << (zs.msg ? zs.msg : "corrupt data") << "\n";
+            ok = false;
+        }
+    }
+
+    if (ok && !memberEnded)
+    {
+        cerr << "Error decompressing gzip input: file is truncated\n";
+        ok = false;
+    }
+
+    inflateEnd(&zs);
+    return ok;
+}
+#endif
+
+#ifdef WITH_ZSTD
+// Decompresses one zstd frame, handing each decoded block to consume(buf, size)
+// consume returns false to stop with an error
+template <typename Consume>
+bool decodeZstdFrame(const char* src, size_t size, Consume consume)
+{
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    if (!dctx)
+    {
+        cerr << "Error starting zstd decompression\n";
+        return false;
+    }
+
+    vector<char> out(ZSTD_DStreamOutSize());
+    ZSTD_inBuffer in = { src, size, 0 };
+    size_t ret = 0;
+    bool more = true;
+
+    while (more)
+    {
+        ZSTD_outBuffer outBuf = { out.data(), out.size(), 0 };
+        ret = ZSTD_decompressStream(dctx, &outBuf, &in);
+        if (ZSTD_isError(ret))
+        {
+            break;
+        }
+        if (!consume(out.data(), outBuf.pos))
+        {
+            ZSTD_freeDCtx(dctx);
+            cerr << "Error decompressing zstd input: frame is bigger than its header says\n";
+            return false;
+        }
+
+        // Keep going while there's input left or output still buffered
+        more = in.pos < in.size || outBuf.pos == outBuf.size;
+    }
+    ZSTD_freeDCtx(dctx);
+
+    // 0 means the frame was fully decoded
+    if (ZSTD_isError(ret) || ret != 0)
+    {
+        cerr << "Error decompressing zstd input: "
+             << (ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "file is truncated") << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Decompresses one zstd frame into data, filtering as it goes
+bool readZstdFrame(const char* src, size_t size, vector<char>& data)
+{
+    // Frames usually record their size, reserve for it
+    unsigned long long contentSize = ZSTD_getFrameContentSize(src, size);
+    if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize != ZSTD_CONTENTSIZE_ERROR)
+    {
+        data.reserve(data.size() + contentSize);
+    }
+
+    return decodeZstdFrame(src, size, [&data](const char* buf, size_t bufSize)
+        {
+            filterChars(buf, bufSize, data);
+            return true;
+        });
+}
+
+// Reads a zstd file
+// zstd frames are independent, so files written as several frames
+// (zstd -T, pzstd, or concatenated .zst files) are decoded in parallel,
+// one frame per thread, each filtered straight into its place in data.
+// That needs every frame's decoded size up front, so if a frame doesn't
+// record it (written from a pipe) the frames are decoded one at a time.
+bool readZstd(ifstream& inFile, size_t fileSize, vector<char>& data)
+{
+    // Load it all to find the frames
+    vector<char> src;
+    if (!loadCompressed(inFile, fileSize, src, "zstd"))
+    {
+        return false;
+    }
+
+    // Offset, size and decoded size of each frame
+    vector<pair<size_t, size_t>> frames;
+    vector<size_t> contentSizes;
+    bool sizesKnown = true;
+    size_t pos = 0;
+    while (pos < src.size())
+    {
+        size_t frameSize = ZSTD_findFrameCompressedSize(src.data() + pos, src.size() - pos);
+        if (ZSTD_isError(frameSize))
+        {
+            cerr << "Error decompressing zstd input: " << ZSTD_getErrorName(frameSize) << "\n";
+            return false;
+        }
+
+        unsigned long long contentSize = ZSTD_getFrameContentSize(src.data() + pos, frameSize);
+        if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR)
+        {
+            sizesKnown = false;
+        }
+        contentSizes.push_back((size_t)contentSize);
+
+        frames.push_back(make_pair(pos, frameSize));
+        pos += frameSize;
+    }
+
+    // One frame, or sizes we can't place, decode straight into data in order
+    if (frames.size() == 1 || !sizesKnown)
+    {
+        for (const pair<size_t, size_t>& frame : frames)
+        {
+            if (!readZstdFrame(src.data() + frame.first, frame.second, data))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Several frames, one per thread at a time
+    return decodePiecesParallel(contentSizes, [&src, &frames, &contentSizes](size_t f, char* out, size_t& kept)
+        {
+            // zstd checks the frame's size itself, but never write past the room it was given
+            size_t decoded = 0;
+            return decodeZstdFrame(src.data() + frames[f].first, frames[f].second,
+                [out, &kept, &decoded, &contentSizes, f](const char* buf, size_t bufSize)
+                {
+                    decoded += bufSize;
+                    if (decoded > contentSizes[f])
+                    {
+                        return false;
+                    }
+                    kept += filterChars(buf, bufSize, out + kept);
+                    return true;
+                });
+        }, data);
+}
+#endif
+
+#ifdef WITH_LZ4
+// Streams lz4 frames from memory through LZ4F into the filter
+// Used when blocks are linked, since each block then needs the ones before it
+bool readLz4Stream(const char* src, size_t size, vector<char>& data)
+{
+    LZ4F_dctx* dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+    {
+        cerr << "Error starting lz4 decompression\n";
+        return false;
+    }
+
+    vector<char> out(ioBlockSize);
+
+    // LZ4F_decompress returns 0 once a frame is complete
+    size_t frameHint = 1;
+    bool ok = true;
+
+    // Keep going while there's input left or output still buffered
+    size_t pos = 0;
+    size_t outSize = 0;
+    while (ok && (pos < size || outSize == out.size()))
+    {
+        size_t srcSize = min(ioBlockSize, size - pos);
+        outSize = out.size();
+        size_t hint = LZ4F_decompress(dctx, out.data(), &outSize, src + pos, &srcSize, NULL);
+        if (LZ4F_isError(hint))
+        {
+            cerr << "Error decompressing lz4 input: " << LZ4F_getErrorName(hint) << "\n";
+            ok = false;
+            break;
+        }
+
+        // A call that did nothing says nothing about the frame
+        if (srcSize > 0 || outSize > 0)
+        {
+            frameHint = hint;
+        }
+        filterChars(out.data(), outSize, data);
+        pos += srcSize;
+    }
+
+    if (ok && frameHint != 0)
+    {
+        cerr << "Error decompressing lz4 input: file is truncated\n";
+        ok = false;
+    }
+
+    LZ4F_freeDecompressionContext(dctx);
+    return ok;
+}
+
+uint32_t readLE32(const unsigned char* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// xxHash32, the checksum lz4 frames use for their header, blocks and content
+// Can be fed in pieces with update(), the digest is the same either way
+struct Xxh32
+{
+    static const uint32_t prime1 = 2654435761U;
+    static const uint32_t prime2 = 2246822519U;
+    static const uint32_t prime3 = 3266489917U;
+    static const uint32_t prime4 = 668265263U;
+    static const uint32_t prime5 = 374761393U;
+
+    uint32_t acc[4];
+
+    // Bytes that didn't fill a 16 byte stripe yet
+    unsigned char buffer[16];
+    size_t buffered;
+    uint64_t total;
+
+    // Seed 0, which is what lz4 uses
+    Xxh32() : buffered(0), total(0)
+    {
+        acc[0] = prime1 + prime2;
+        acc[1] = prime2;
+        acc[2] = 0;
+        acc[3] = 0 - prime1;
+    }
+
+    static uint32_t rotl(uint32_t x, int r)
+    {
+        return (x << r) | (x >> (32 - r));
+    }
+
+    void stripe(const unsigned char* p)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            acc[i] = rotl(acc[i] + readLE32(p + 4 * i) * prime2, 13) * prime1;
+        }
+    }
+
+    void update(const void* data, size_t size)
+    {
+        if (size == 0)
+        {
+            return;
+        }
+        const unsigned char* p = (const unsigned char*)data;
+        total += size;
+
+        // Finish the stripe left over from the last call first
+        if (buffered > 0)
+        {
+            size_t take = min(size, sizeof(buffer) - buffered);
+            memcpy(buffer + buffered, p, take);
+            buffered += take;
+            p += take;
+            size -= take;
+            if (buffered < sizeof(buffer))
+            {
+                return;
+            }
+            stripe(buffer);
+            buffered = 0;
+        }
+
+        for (; size >= 16; p += 16, size -= 16)
+        {
+            stripe(p);
+        }
+        memcpy(buffer, p, size);
+        buffered = size;
+    }
+
+    uint32_t digest() const
+    {
+        uint32_t h = total >= 16
+            ? rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18)
+            : prime5;
+        h += (uint32_t)total;
+
+        size_t i = 0;
+        for (; i + 4 <= buffered; i += 4)
+        {
+            h = rotl(h + readLE32(buffer + i) * prime3, 17) * prime4;
+        }
+        for (; i < buffered; i++)
+        {
+            h = rotl(h + buffer[i] * prime5, 11) * prime1;
+        }
+
+        h ^= h >> 15;
+        h *= prime2;
+        h ^= h >> 13;
+        h *= prime3;
+        h ^= h >> 16;
+        return h;
+    }
+
+    static uint32_t hash(const void* data, size_t size)
+    {
+        Xxh32 h;
+        h.update(data, size);
+        return h.digest();
+    }
+};
+
+// What readLz4 checks at the end of each frame
+struct Lz4Frame
+{
+    bool contentChecksum;
+    uint32_t checksum;
+};
+
+// Where one lz4 block's data sits in the file
+struct Lz4Block
+{
+    size_t offset;
+    size_t size;
+
+    // Blocks that didn't compress are stored as is
+    bool compressed;
+
+    // Most it can decode to: its frame's block size, or size if stored
+    size_t decodedMax;
+
+    // A block checksum of the stored data follows it
+    bool checksum;
+
+    // Its frame, and its place among the blocks whose frame has a content
+    // checksum (SIZE_MAX if it doesn't)
+    size_t frame;
+    size_t hashOrder;
+};
+
+// Walks the frame and block headers of an lz4 file to find every block
+// Every block header stores that block's compressed size, so no decoding
+// is needed. Returns false if any frame links its blocks, or if something
+// doesn't parse or fails the header checksum, and the caller streams the
+// file through LZ4F instead, which reports the error
+bool findLz4Blocks(const vector<char>& src, vector<Lz4Block>& blocks, vector<Lz4Frame>& frames)
+{
+    const unsigned char* p = (const unsigned char*)src.data();
+    size_t size = src.size();
+    size_t pos = 0;
+    size_t hashCount = 0;
+
+    while (pos < size)
+    {
+        if (size - pos < 8)
+        {
+            return false;
+        }
+        uint32_t magic = readLE32(p + pos);
+
+        // Skippable frames carry their own length
+        if ((magic & 0xFFFFFFF0) == 0x184D2A50)
+        {
+            size_t skip = readLE32(p + pos + 4);
+            if (size - pos - 8 < skip)
+            {
+                return false;
+            }
+            pos += 8 + skip;
+            continue;
+        }
+        if (magic != 0x184D2204)
+        {
+            return false;
+        }
+
+        // Frame descriptor: FLG, BD, optional content size and dictionary id, header checksum
+        unsigned char flg = p[pos + 4];
+        unsigned char bd = p[pos + 5];
+        bool independent = (flg & 0x20) != 0;
+        bool blockChecksum = (flg & 0x10) != 0;
+        bool contentChecksum = (flg & 0x04) != 0;
+        int blockSizeId = (bd >> 4) & 7;
+        if ((flg >> 6) != 1 || !independent || blockSizeId < 4)
+        {
+            return false;
+        }
+
+        size_t blockMax = (size_t)1 << (8 + 2 * blockSizeId);
+
+        size_t headerSize = 7 + ((flg & 0x08) ? 8 : 0) + ((flg & 0x01) ? 4 : 0);
+        if (size - pos < headerSize)
+        {
+            return false;
+        }
+
+        // The header checksum is the second byte of the descriptor's xxHash
+        if (((Xxh32::hash(p + pos + 4, headerSize - 5) >> 8) & 0xFF) != p[pos + headerSize - 1])
+        {
+            return false;
+        }
+        pos += headerSize;
+
+        Lz4Frame frame;
+        frame.contentChecksum = contentChecksum;
+        frame.checksum = 0;
+        frames.push_back(frame);
+
+        // Blocks until the zero end mark
+        while (true)
+        {
+            if (size - pos < 4)
+            {
+                return false;
+            }
+            uint32_t header = readLE32(p + pos);
+            pos += 4;
+            if (header == 0)
+            {
+                break;
+            }
+
+            Lz4Block block;
+            block.offset = pos;
+            block.size = header & 0x7FFFFFFF;
+            block.compressed = (header & 0x80000000) == 0;
+            block.decodedMax = block.compressed ? blockMax : block.size;
+            block.checksum = blockChecksum;
+            block.frame = frames.size() - 1;
+            block.hashOrder = contentChecksum ? hashCount++ : SIZE_MAX;
+            size_t stored = block.size + (blockChecksum ? 4 : 0);
+            if (block.size > blockMax || size - pos < stored)
+            {
+                return false;
+            }
+            blocks.push_back(block);
+            pos += stored;
+        }
+
+        if (contentChecksum)
+        {
+            if (size - pos < 4)
+            {
+                return false;
+            }
+            frames.back().checksum = readLE32(p + pos);
+            pos += 4;
+        }
+    }
+    return true;
+}
+
+// Reads an lz4 file
+// The lz4 tool writes independent blocks by default, and then each block
+// is decoded on its own thread with LZ4_decompress_safe, straight into its
+// place in data, and its block checksum is checked on the same thread.
+// The content checksum hashes the whole frame in order, so blocks take
+// turns adding to it. Hashing is much faster than decoding, so the turns
+// are short. Linked blocks, or anything that doesn't parse, are streamed
+// through LZ4F.
+bool readLz4(ifstream& inFile, size_t fileSize, vector<char>& data)
+{
+    vector<char> src;
+    if (!loadCompressed(inFile, fileSize, src, "lz4"))
+    {
+        return false;
+    }
+
+    vector<Lz4Block> blocks;
+    vector<Lz4Frame> frames;
+    if (!findLz4Blocks(src, blocks, frames) || blocks.size() < 2)
+    {
+        return readLz4Stream(src.data(), src.size(), data);
+    }
+
+    vector<size_t> bounds;
+    for (const Lz4Block& block : blocks)
+    {
+        bounds.push_back(block.decodedMax);
+    }
+
+    // Each frame's content hash so far, and the hashOrder of the block
+    // whose turn it is. A failed block sets nextHash to SIZE_MAX so the
+    // blocks waiting behind it give up.
+    vector<Xxh32> contentHashes(frames.size());
+    atomic<size_t> nextHash(0);
+
+    bool ok = decodePiecesParallel(bounds, [&src, &blocks, &contentHashes, &nextHash](size_t b, char* out, size_t& kept)
+        {
+            const Lz4Block& block = blocks[b];
+            const char* blockData = src.data() + block.offset;
+
+            auto fail = [&nextHash](const char* error)
+                {
+                    cerr << "Error decompressing lz4 input: " << error << "\n";
+                    nextHash = SIZE_MAX;
+                    nextHash.notify_all();
+                    return false;
+                };
+
+            // The block checksum covers the block as stored
+            if (block.checksum &&
+                Xxh32::hash(blockData, block.size) != readLE32((const unsigned char*)blockData + block.size))
+            {
+                return fail("block checksum mismatch");
+            }
+
+            const char* decoded = blockData;
+            size_t decodedSize = block.size;
+            if (block.compressed)
+            {
+                // Decode into place, it's filtered where it is below
+                int outSize = LZ4_decompress_safe(blockData, out, (int)block.size, (int)block.decodedMax);
+                if (outSize < 0)
+                {
+                    return fail("corrupt block");
+                }
+                decoded = out;
+                decodedSize = (size_t)outSize;
+            }
+
+            if (block.hashOrder != SIZE_MAX)
+            {
+                // Wait for the blocks before this one to be hashed
+                size_t turn = nextHash.load();
+                while (turn != block.hashOrder)
+                {
+                    if (turn == SIZE_MAX)
+                    {
+                        return false;
+                    }
+                    nextHash.wait(turn);
+                    turn = nextHash.load();
+                }
+
+                contentHashes[block.frame].update(decoded, decodedSize);
+
+                // Hand over the turn, unless a failure has taken it already
+                nextHash.compare_exchange_strong(turn, turn + 1);
+                nextHash.notify_all();
+            }
+
+            kept = filterChars(decoded, decodedSize, out);
+            return true;
+        }, data);
+    if (!ok)
+    {
+        return false;
+    }
+
+    for (size_t f = 0; f < frames.size(); f++)
+    {
+        if (frames[f].contentChecksum && contentHashes[f].digest() != frames[f].checksum)
+        {
+            cerr << "Error decompressing lz4 input: content checksum mismatch\n";
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// Reads the input file, decompressing it if needed, and keeps only valid characters
+// Decompressed data goes straight into the filter, there's no temporary file
+bool readInput(const char* path, vector<char>& data, size_t& fileSize)
+{
+    // Opens input file in binary mode
+    ifstream inFile(path, ios::binary);
+
+    // Check if file is opened successfully
+    if (!inFile)
+    {
+        cerr << "Error opening input file\n";
+        return false;
+    }
+
+    // Get file size by moving to end and checking position
+    inFile.seekg(0, ios::end);
+    fileSize = inFile.tellg();
+    inFile.seekg(0, ios::beg);
+
+    // Look at the first bytes to see whether it's compressed
+    unsigned char head[4] = {};
+    inFile.read((char*)head, sizeof(head));
+    StreamFormat format = detectInputFormat(head, (size_t)inFile.gcount());
+    inFile.clear();
+    inFile.seekg(0, ios::beg);
+
+    if (!formatSupported(format))
+    {
+        cerr << "Input file is " << formatName(format) << " compressed, but this build has no "
+             << formatName(format) << " support\n";
+        return false;
+    }
+
+    bool ok = false;
+    switch (format)
+    {
+#ifdef WITH_ZLIB
+    case StreamFormat::Gzip:
+        ok = readGzip(inFile, data);
+        break;
+#endif
+#ifdef WITH_ZSTD
+    case StreamFormat::Zstd:
+        ok = readZstd(inFile, fileSize, data);
+        break;
+#endif
+#ifdef WITH_LZ4
+    case StreamFormat::Lz4:
+        ok = readLz4(inFile, fileSize, data);
+        break;
+#endif
+    default:
+        // Pre allocate to avoid resizing
+        data.reserve(fileSize);
+        ok = readPlain(inFile, data);
+        if (!ok)
+        {
+            cerr << "Error reading input file\n";
+        }
+        break;
+    }
+    return ok;
+}
+
+// Where the sorted output goes: a plain file, or a compressor in front of one
+struct OutputSink
+{
+    ofstream file;
+    bool failed;
+
+    // Set with --verify, is handed everything as it's written
+    // Whatever writeAll is given must stay in memory until it finishes
+    StreamVerifier* verifier;
+
+    OutputSink(const char* path) : file(path, ios::binary), failed(!file), verifier(NULL)
+    {
+    }
+
+    virtual ~OutputSink()
+    {
+    }
+
+    // Takes at most ioBlockSize bytes at a time
+    virtual void write(const char* buf, size_t size)
+    {
+        writeFile(buf, size);
+    }
+
+    // Flushes anything buffered and closes the file
+    virtual void finish()
+    {
+        file.close();
+        if (!file)
+        {
+            failed = true;
+        }
+    }
+
+    // Splits any amount of data into write() sized blocks
+    void writeAll(const char* buf, size_t size)
+    {
+        if (verifier)
+        {
+            verifier->check(buf, size);
+        }
+
+        for (size_t pos = 0; pos < size; pos += ioBlockSize)
+        {
+            write(buf + pos, min(ioBlockSize, size - pos));
+        }
+    }
+
+    void writeFile(const char* buf, size_t size)
+    {
+        if (!failed && size > 0)
+        {
+            file.write(buf, size);
+            if (!file)
+            {
+                failed = true;
+            }
+        }
+    }
+};
+
+#ifdef WITH_ZLIB
+struct GzipSink : OutputSink
+{
+    z_stream zs;
+    vector<char> out;
+
+    GzipSink(const char* path) : OutputSink(path), out(ioBlockSize)
+    {
+        memset(&zs, 0, sizeof(zs));
+
+        // 15 + 16: write a gzip header rather than a zlib one
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            failed = true;
+        }
+    }
+
+    ~GzipSink()
+    {
+        deflateEnd(&zs);
+    }
+
+    void write(const char* buf, size_t size) override
+    {
+        compress(buf, size, Z_NO_FLUSH);
+    }
+
+    void finish() override
+    {
+        compress(NULL, 0, Z_FINISH);
+        OutputSink::finish();
+    }
+
+    void compress(const char* buf, size_t size, int flush)
+    {
+        zs.next_in = (Bytef*)buf;
+        zs.avail_in = (uInt)size;
+
+        // Run deflate until it stops filling the output buffer
+        do
+        {
+            zs.next_out = (Bytef*)out.data();
+            zs.avail_out = (uInt)out.size();
+            if (deflate(&zs, flush) == Z_STREAM_ERROR)
+            {
+                failed = true;
+                return;
+            }
+            writeFile(out.data(), out.size() - zs.avail_out);
+        } while (zs.avail_out == 0);
+    }
+};
+#endif
+
+#ifdef WITH_ZSTD
+struct ZstdSink : OutputSink
+{
+    ZSTD_CCtx* cctx;
+    vector<char> out;
+
+    ZstdSink(const char* path) : OutputSink(path), cctx(ZSTD_createCCtx()), out(ZSTD_CStreamOutSize())
+    {
+        if (!cctx)
+        {
+            failed = true;
+            return;
+        }
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 3);
+
+        // Compress on zstd's own worker threads too, if the library was built with them
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, (int)thread::hardware_concurrency());
+    }
+
+    ~ZstdSink()
+    {
+        ZSTD_freeCCtx(cctx);
+    }
+
+    void write(const char* buf, size_t size) override
+    {
+        compress(buf, size, ZSTD_e_continue);
+    }
+
+    void finish() override
+    {
+        compress(NULL, 0, ZSTD_e_end);
+        OutputSink::finish();
+    }
+
+    void compress(const char* buf, size_t size, ZSTD_EndDirective mode)
+    {
+        if (failed)
+        {
+            return;
+        }
+
+        ZSTD_inBuffer in = { buf, size, 0 };
+        bool done = false;
+        while (!done)
+        {
+            ZSTD_outBuffer outBuf = { out.data(), out.size(), 0 };
+            size_t remaining = ZSTD_compressStream2(cctx, &outBuf, &in, mode);
+            if (ZSTD_isError(remaining))
+            {
+                failed = true;
+                return;
+            }
+            writeFile(out.data(), outBuf.pos);
+
+            // When ending, stop once zstd has nothing left to flush
+            done = mode == ZSTD_e_end ? remaining == 0 : in.pos == in.size;
+        }
+    }
+};
+#endif
+
+#ifdef WITH_LZ4
+struct Lz4Sink : OutputSink
+{
+    LZ4F_cctx* cctx;
+    vector<char> out;
+
+    Lz4Sink(const char* path) : OutputSink(path), cctx(NULL)
+    {
+        if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))
+        {
+            failed = true;
+            return;
+        }
+
+        // Big enough for the frame header or any one write()
+        out.resize(LZ4F_compressBound(ioBlockSize, NULL));
+        size_t headerSize = LZ4F_compressBegin(cctx, out.data(), out.size(), NULL);
+        check(headerSize);
+    }
+
+    ~Lz4Sink()
+    {
+        LZ4F_freeCompressionContext(cctx);
+    }
+
+    void write(const char* buf, size_t size) override
+    {
+        if (!failed)
+        {
+            check(LZ4F_compressUpdate(cctx, out.data(), out.size(), buf, size, NULL));
+        }
+    }
+
+    void finish() override
+    {
+        if (!failed)
+        {
+            check(LZ4F_compressEnd(cctx, out.data(), out.size(), NULL));
+        }
+        OutputSink::finish();
+    }
+
+    // Writes what an LZ4F call produced, or marks the sink failed
+    void check(size_t result)
+    {
+        if (LZ4F_isError(result))
+        {
+            failed = true;
+            return;
+        }
+        writeFile(out.data(), result);
+    }
+};
+#endif
+
+// Opens the output file, compressing if its extension asks for it
+// Returns NULL after printing an error if that's not possible
+unique_ptr<OutputSink> openOutput(const char* path)
+{
+    StreamFormat format = outputFormatFor(path);
+    if (!formatSupported(format))
+    {
+        cerr << "Output file asks for " << formatName(format) << " compression, but this build has no "
+             << formatName(format) << " support\n";
+        return NULL;
+    }
+
+    unique_ptr<OutputSink> sink;
+    switch (format)
+    {
+#ifdef WITH_ZLIB
+    case StreamFormat::Gzip:
+        sink.reset(new GzipSink(path));
+        break;
+#endif
+#ifdef WITH_ZSTD
+    case StreamFormat::Zstd:
+        sink.reset(new ZstdSink(path));
+        break;
+#endif
+#ifdef WITH_LZ4
+    case StreamFormat::Lz4:
+        sink.reset(new Lz4Sink(path));
+        break;
+#endif
+    default:
+        sink.reset(new OutputSink(path));
+        break;
+    }
+
+    if (sink->failed)
+    {
+        cerr << "Error opening output file\n";
+        return NULL;
+    }
+    return sink;
+}
+
+// Final merge of [0, mid] and [mid + 1, end] with the output written as it's made
+// The merge fills temp from the front one block at a time, and a writer
+// thread compresses and writes each finished block while the merge carries on
+template <typename Index, typename Compare>
+void mergeToSink(vector<char>& arr, Index mid, Compare comp, OutputSink& sink)
+{
+    uint64_t startTime = ThreadTimer::getTime();
+
+    Index right = (Index)(arr.size() - 1);
+    size_t size = arr.size();
+    vector<char> temp(size);
+
+    // How much of temp is merged, the writer sleeps on this
+    atomic<size_t> merged(0);
+
+    thread writer([&temp, &merged, &sink, size]()
+        {
+            PerfCounters writeCounters;
+            writeCounters.start();
+
+            size_t written = 0;
+            while (written < size)
+            {
+                merged.wait(written);
+                size_t available = merged.load();
+                sink.writeAll(temp.data() + written, available - written);
+                written = available;
+            }
+
+            writeCounters.stop("write", 0, size - 1);
+        });
+
+    Index i = 0;
+    Index j = mid + 1;
+    size_t k = 0;
+
+    // Merge one block, then let the writer have it
+    while (i <= mid && j <= right)
+    {
+        size_t blockEnd = min(k + ioBlockSize, size);
+        while (k < blockEnd && i <= mid && j <= right)
+        {
+            if (comp(arr[i], arr[j]))
+            {
+                temp[k++] = arr[i++];
+            }
+            else
+            {
+                temp[k++] = arr[j++];
+            }
+        }
+
+        merged.store(k);
+        merged.notify_one();
+    }
+
+    // Copy remaining elements from whichever half is left
+    while (i <= mid)
+    {
+        temp[k++] = arr[i++];
+    }
+    while (j <= right)
+    {
+        temp[k++] = arr[j++];
+    }
+    merged.store(k);
+    merged.notify_one();
+
+    writer.join();
+
+    // This is the whole array, so keep temp rather than copy it back
+    arr.swap(temp);
+
+    uint64_t endTime = ThreadTimer::getTime();
+    cout << "Thread " << this_thread::get_id()
+         << " merge time for segment [0," << right << "]: "
+         << (endTime - startTime) << " units\n";
+}
+
+// Sorts arr and writes it to sink, overlapping the write with the final merge
+// Both halves are sorted just as parallelMergeSort would, then mergeToSink
+// streams the last merge out
+template <typename Index, typename Compare>
+void parallelMergeSortToSink(vector<char>& arr, int depth, Compare comp, OutputSink& sink)
+{
+    Index right = (Index)(arr.size() - 1);
+    if (right == 0)
+    {
+        sink.writeAll(arr.data(), arr.size());
+        return;
+    }
+
+    // Find middle
+    Index mid = right / 2;
+
+    if (depth > 0)
+    {
+        // Left half on a new thread, right half on this one
+        thread leftThread([&arr, mid, depth, comp]()
+            {
+                parallelMergeSort(arr, (Index)0, mid, depth - 1, comp);
+            });
+        parallelMergeSort(arr, mid + 1, right, depth - 1, comp);
+        leftThread.join();
+    }
+    else
+    {
+        parallelMergeSort(arr, (Index)0, mid, 0, comp);
+        parallelMergeSort(arr, mid + 1, right, 0, comp);
+    }
+
+    PerfCounters mergeCounters;
+    mergeCounters.start();
+    mergeToSink(arr, mid, comp, sink);
+    mergeCounters.stop("merge", 0, right);
+}
+
+// Same as sortData, but the output is written to sink as the final merge runs
+template <typename Compare>
+void sortDataToSink(vector<char>& arr, int depth, Compare comp, OutputSink& sink)
+{
+    if (arr.empty())
+    {
+        return;
+    }
+
+    withIndexType(arr.size(), [&arr, depth, comp, &sink](auto zero)
+        {
+            parallelMergeSortToSink<decltype(zero)>(arr, depth, comp, sink);
+        });
+}
+
+// Main function:
+// - Will process command line arguments
+// - Reads and filters input file
+// - Background timer thread
+// - Initiates Parallel sorting
+// - Write results and timing information
+int main(int argc, char* argv[])
+{
+    // Check command line arguments
+    // Checks for at least 4 arguments, anything after thread_depth is an option
+    // Prints usage instructions if incorrect number of arguments
+    bool badOption = false;
+    bool verifyOutput = false;
+    for (int i = 4; i < argc; i++)
+    {
+        if (string(argv[i]) == "--perf-counters")
+        {
+            PerfCounters::enabled = true;
+        }
+        else if (string(argv[i]) == "--verify")
+        {
+            verifyOutput = true;
+        }
+        else
+        {
+            cerr << "Unknown option: " << argv[i] << "\n";
+            badOption = true;
+        }
+    }
+
+    if (argc < 4 || badOption)
+    {
+        cerr << "Usage: " << argv[0] << " <input_file> <output_file> <thread_depth> [--perf-counters] [--verify]\n";
+        cerr << "thread_depth: 0 for regular, 1 for 2 threads, 2 for 4 threads, etc.\n";
+        cerr << "--perf-counters: print hardware counters per phase and thread as perf,... CSV lines\n";
+        cerr << "--verify: check the output is sorted and has the same characters as the input\n";
+        cerr << "Compressed input (gzip, zstd, lz4) is detected automatically, output is compressed\n";
+        cerr << "when output_file ends in .gz, .zst or .lz4\n";
+        return 1;
+    }
+
+    // Check the counters can be opened before relying on them
+    // If not, keep going and report them as NA
+    if (PerfCounters::enabled)
+    {
+        PerfCounters probe;
+        probe.start();
+        if (!probe.anyAvailable())
+        {
+            cerr << "Performance counters unavailable on this system, they will be reported as NA\n";
+        }
+    }
+
+    // Count the read and filter phase on this thread
+    // Parallel zstd/lz4 decoding adds its own read rows from each worker
+    PerfCounters readCounters;
+    readCounters.start();
+
+    // Read entire file into memory, decompressing it if needed
+    vector<char> data;
+
+    size_t fileSize = 0;
+    if (!readInput(argv[1], data, fileSize))
+    {
+        return 1;
+    }
+    readCounters.stop("read", 0, data.size() > 0 ? data.size() - 1 : 0);
+
+    // Check to see if any valid characters are found
+    if (data.empty())
+    {
+        cerr << "No valid characters found in the input file, remember only numbers, upper & lowercase letters are allowed!\n";
+        return 1;
+    }
+
+    // Get thread depth from command line
+    // Converts third argument into integer for thread depth, makes sure thread depth is not negative
+    // stoi converts string to int
+    int threadDepth = stoi(argv[3]);
+    if (threadDepth < 0)
+    {
+        cerr << "Thread depth must be non-negative\n";
+        return 1;
+    }
+
+    // Print initial info
+    // Print sorting parameters, input size, and thread configuration
+    cout << "Starting sort with parameters:\n"
+         << "Input size: " << data.size() << " characters\n"
+         << "Thread depth: " << threadDepth << "\n"
+         << "Maximum possible threads: " << (1 << threadDepth) << "\n\n";
+
+    // Start a timer thread
+    // Background thread for timing
+    thread timerThread([]()
+        {
+            while (true)
+            {
+                // Thread continuously increments timer
+                ThreadTimer::incremementTimer();
+
+                // Sleep to prevent excessive CPU usage
+                this_thread::yield();
+            }
+        });
+    // Let it run independantly 
+    timerThread.detach();
+
+    // Count the input characters for --verify before they get sorted
+    // This is part of the verify overhead, so it's timed with it
+    uint64_t verifyTime = 0;
+    CharHistogram inputCounts;
+    if (verifyOutput)
+    {
+        uint64_t verifyStart = ThreadTimer::getTime();
+        inputCounts = countParallel(data);
+        verifyTime = ThreadTimer::getTime() - verifyStart;
+    }
+
+    // Get start time
+    uint64_t startTime = ThreadTimer::getTime();
+
+    // Open the output first, no point sorting if it can't be written
+    unique_ptr<OutputSink> sink = openOutput(argv[2]);
+    if (!sink)
+    {
+        return 1;
+    }
+
+    // With --verify, every block is checked on the verifier's threads as it's written
+    unique_ptr<StreamVerifier> verifier;
+    if (verifyOutput)
+    {
+        verifier.reset(new StreamVerifier());
+        sink->verifier = verifier.get();
+    }
+
+    // Sort the data
+    // The output is written while the final merge runs, so the total time
+    // below includes writing (and compressing) it. The --verify checks run
+    // on the verifier's threads and aren't part of it.
+    sortDataToSink(data, threadDepth, CompareMerge(), *sink);
+
+    // Flush the compressor and close the output file
+    sink->finish();
+
+    // Records end time
+    uint64_t endTime = ThreadTimer::getTime();
+
+    if (sink->failed)
+    {
+        cerr << "Error writing output file\n";
+        return 1;
+    }
+
+    // Check what the verifier saw
+    // Waiting for it to catch up is verify time, the checking it did
+    // alongside the final merge isn't counted anywhere
+    if (verifyOutput)
+    {
+        uint64_t verifyStart = ThreadTimer::getTime();
+        verifier->finish();
+        verifyTime += ThreadTimer::getTime() - verifyStart;
+
+        bool verified = true;
+        if (verifier->firstBad != SIZE_MAX)
+        {
+            cerr << "Verify failed: '" << data[verifier->firstBad] << "' at index " << verifier->firstBad
+                 << " is followed by '" << data[verifier->firstBad + 1] << "'\n";
+            verified = false;
+        }
+        for (int c = 0; c < 256; c++)
+        {
+            if (inputCounts[c] != verifier->counts[c])
+            {
+                cerr << "Verify failed: input has " << inputCounts[c] << " '" << (char)c
+                     << "' but output has " << verifier->counts[c] << "\n";
+                verified = false;
+            }
+        }
+
+        // Don't leave bad output behind
+        if (!verified)
+        {
+            remove(argv[2]);
+            cerr << "Output file removed\n";
+            return 1;
+        }
+    }
 
     // Print performance results
     // Total time taken
@@ -361,6 +2816,20 @@ int main(int argc, char* argv[])
         << (data.size() * 1.0 / (endTime - startTime))
         << " characters per unit time\n";
 
+    // Verification overhead: counting the input, and waiting for the output
+    // check after the end time was taken. Neither is in the total above.
+    if (verifyOutput)
+    {
+        cout << "Verify time: " << verifyTime << " units (output verified)\n";
+    }
+
+    // Machine-readable counters, one line per phase and thread
+    if (PerfCounters::enabled)
+    {
+        cout << "\n";
+        PerfCounters::printRecords(cout);
+    }
+
     return 0;
 
 }
@@ -212,6 +212,12 @@ void parallelMergeSort(char* arr, int left, int right, int depth)
     cout << "Thread " << this_thread::get_id()
         << " right half time: " << (rightEnd - rightStart) << " units\n";
 
+    // Wait for the left half to finish before merging
+    leftThread.join();
+
+    // Merge the two sorted halves
+    merge(arr, left, mid, right);
+
     }
 }
 
@@ -277,7 +283,7 @@ int main(int argc, char* argv[])
     // Check to see if the file opened successfuly
     if (!inFile)
     {
-        cerr < "error opening input file\n";
+        cerr << "error opening input file\n";
         return 1;
     }
 